@@ -22,26 +22,51 @@
 #include <string.h>
 #include <cmath>
 #include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <utility>
+#include <string>
 #ifdef WIN32
 #define strcasecmp _stricmp
+#define fseeko _fseeki64
 #endif
 
 #include <imageIO.h>
+#include <imageFormats.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
 #define MAX_TRIANGLES 20000
 #define MAX_SPHERES 100
 #define MAX_LIGHTS 100
+#define MAX_SAMPLES 64
 
 char * filename = NULL;
+char * scene_filename = NULL;
 
 //different display modes
 #define MODE_DISPLAY 1
 #define MODE_JPEG 2
 
 int mode = MODE_DISPLAY;
-bool antialiasing = true;
+
+//per-pixel cost maps written next to the image
+#define HEATMAP_NONE 0
+#define HEATMAP_PPM 1
+#define HEATMAP_PNG 2
+#define HEATMAP_RAW 3
+
+int heatmap = HEATMAP_NONE;
+
+// wall-clock budget in milliseconds for the deadline-driven render mode, 0 renders to completion
+int time_budget = 0;
+
+// periodic checkpoints of the tiled render, and resuming from them
+char * checkpoint_filename = NULL;
+int checkpoint_interval = 60;
+bool resume = false;
 
 //you may want to make these smaller for debugging purposes
 #define WIDTH 640
@@ -55,6 +80,46 @@ const double FOV_FACTOR = tan((fov / 2.0) * (3.1415926535 / 180.0));
 
 unsigned char buffer[HEIGHT][WIDTH][3];
 
+// work done while tracing a pixel
+struct PixelCost
+{
+	long long intersections;
+	long long shadowRays;
+	double seconds;
+};
+
+// cost of the pixel being traced and of every traced pixel
+PixelCost pixelCost;
+PixelCost costBuffer[HEIGHT][WIDTH];
+
+// the image is traced in square tiles, ordered from the center outwards
+#define TILE_SIZE 32
+
+struct Tile
+{
+	int x0, y0;
+	int x1, y1;
+};
+
+// quality levels of the deadline-driven render mode, from cheapest to best
+// levels without antialiasing trace one ray through the pixel center
+struct QualityLevel
+{
+	int scale;
+	bool antialiasing;
+	const char * name;
+};
+
+const QualityLevel qualityLevels[] =
+{
+	{ TILE_SIZE, false, "one ray per tile" },
+	{ 8, false, "1/8 resolution" },
+	{ 4, false, "1/4 resolution" },
+	{ 2, false, "1/2 resolution" },
+	{ 1, false, "full resolution" },
+	{ 1, true, "full resolution, antialiased" },
+};
+
 struct Vertex
 {
 	double position[3];
@@ -84,18 +149,103 @@ struct Light
 	double color[3];
 };
 
+struct Bounds
+{
+	glm::highp_dvec3 min;
+	glm::highp_dvec3 max;
+};
+
 Triangle triangles[MAX_TRIANGLES];
 Sphere spheres[MAX_SPHERES];
 Light lights[MAX_LIGHTS];
+
+// out-of-core geometry: instead of triangles[], triangles are streamed to a staging file
+// while the scene is read, sorted along a Morton curve by their centroids and written to the
+// cluster file in clusters of CLUSTER_SIZE neighbouring triangles
+// a bounding volume hierarchy over the clusters stays in memory, and clusters are paged
+// on demand into a cache of at most cluster_cache_mb
+#define CLUSTER_SIZE 256
+
+bool out_of_core = false;
+char * cluster_filename = NULL;
+int cluster_cache_mb = 64;
+
+// node of the cluster hierarchy, leaves refer to a cluster and have no children
+struct ClusterNode
+{
+	Bounds bounds;
+	int left, right;
+	int cluster;
+};
+
+// Morton code of a triangle centroid and the position of the triangle in the staging file
+struct TriangleKey
+{
+	unsigned long long code;
+	int index;
+};
+
+// sorted run of keys in the key file, read back a buffer at a time while merging
+struct KeyRun
+{
+	long long next, end;
+	std::vector<TriangleKey> keys;
+	size_t pos;
+};
+
+struct ClusterSlot
+{
+	int cluster;
+	int pins;
+	unsigned long long lastUse;
+};
+
+struct ClusterStats
+{
+	long long faults;
+	long long hits;
+	long long evictions;
+	double bytesRead;
+	double ioSeconds;
+};
+
+FILE * clusterFile = NULL;
+FILE * stagingFile = NULL;
+FILE * keyFile = NULL;
+std::string staging_filename;
+std::string key_filename;
+Bounds centroidBounds = { glm::highp_dvec3(1e30), glm::highp_dvec3(-1e30) };
+int num_clusters = 0;
+std::vector<ClusterNode> clusterNodes;
+std::vector<int> clusterSlots;
+std::vector<ClusterSlot> cacheSlots;
+std::vector<Triangle> cacheMemory;
+unsigned long long cacheClock = 0;
+ClusterStats clusterStats;
 double ambient_light[3];
 
 int num_triangles = 0;
 int num_spheres = 0;
 int num_lights = 0;
 
+// approximate shadows from precomputed cube-map depth buffers (off by default)
+bool shadow_maps = false;
+int shadow_map_resolution = 256;
+double shadow_map_bias = 6.0;
+int shadow_map_pcf = 0;
+
+// distance to the nearest occluder for every texel of the 6 cube faces around a light
+struct ShadowMap
+{
+	std::vector<float> depth;
+};
+
+ShadowMap shadowMaps[MAX_LIGHTS];
+
 void plot_pixel_display(int x, int y, unsigned char r, unsigned char g, unsigned char b);
 void plot_pixel_jpeg(int x, int y, unsigned char r, unsigned char g, unsigned char b);
 void plot_pixel(int x, int y, unsigned char r, unsigned char g, unsigned char b);
+void plot_cost(int x, int y);
 
 glm::highp_dvec3 clampColor(glm::highp_dvec3 color)
 {
@@ -121,6 +271,10 @@ class Ray
 	glm::highp_dvec3 dir;
 
 public:
+	Ray()
+	{
+	}
+
 	Ray(glm::highp_dvec3 position, glm::highp_dvec3 direction)
 	{
 		pos = position;
@@ -128,7 +282,7 @@ public:
 	}
 
 	// check if ray intersects with triangle
-	bool triangleIntersect(const Triangle & triangle, glm::highp_dvec3 & intersection)
+	bool triangleIntersect(const Triangle & triangle, glm::highp_dvec3 & intersection) const
 	{
 		glm::highp_dvec3 v0 = { triangle.v[0].position[0], triangle.v[0].position[1], triangle.v[0].position[2] };
 		glm::highp_dvec3 v1 = { triangle.v[1].position[0], triangle.v[1].position[1], triangle.v[1].position[2] };
@@ -167,7 +321,7 @@ public:
 	}
 
 	// check if ray intersects with sphere
-	bool sphereIntersect(const Sphere & sphere, glm::highp_dvec3 & intersection)
+	bool sphereIntersect(const Sphere & sphere, glm::highp_dvec3 & intersection) const
 	{
 		double b, c;
 		glm::highp_dvec3 center = { sphere.position[0], sphere.position[1], sphere.position[2] };
@@ -201,115 +355,573 @@ public:
 		intersection = pos + (dir * t0);
 		return true;
 	}
+
+	glm::highp_dvec3 origin() const
+	{
+		return pos;
+	}
+
+	// check if ray hits an axis-aligned box closer than maxDistance (slab test)
+	// entry is the distance at which the ray enters the box
+	bool boxIntersect(const Bounds & box, double maxDistance, double & entry) const
+	{
+		double tmin = 0.0;
+		double tmax = maxDistance;
+		for (int a = 0; a < 3; a++)
+		{
+			double t0 = (box.min[a] - pos[a]) / dir[a];
+			double t1 = (box.max[a] - pos[a]) / dir[a];
+			if (t0 > t1)
+				std::swap(t0, t1);
+
+			// NaN from a zero direction component compares false and is ignored
+			tmin = std::max(tmin, t0);
+			tmax = std::min(tmax, t1);
+			if (tmax < tmin)
+				return false;
+		}
+		entry = tmin;
+		return true;
+	}
 };
 
-// send a ray from camera to each pixel
-Ray cameraRay(double _x, double _y)
+Bounds triangleBounds(const Triangle & t)
 {
-	glm::highp_dvec3 startPt = { 0.0, 0.0, 0.0 };
+	Bounds bounds = { glm::highp_dvec3(1e30), glm::highp_dvec3(-1e30) };
+	for (int j = 0; j < 3; j++)
+	{
+		glm::highp_dvec3 p = { t.v[j].position[0], t.v[j].position[1], t.v[j].position[2] };
+		bounds.min = glm::min(bounds.min, p);
+		bounds.max = glm::max(bounds.max, p);
+	}
+	return bounds;
+}
 
-	double x, y;
-	// normalized device coordinates
-	x = (_x + 0.5) / WIDTH;
-	y = (_y + 0.5) / HEIGHT;
+Bounds boundsUnion(const Bounds & a, const Bounds & b)
+{
+	Bounds bounds = { glm::min(a.min, b.min), glm::max(a.max, b.max) };
+	return bounds;
+}
 
-	// screen coordinates
-	x = 2 * x - 1;
-	y = 2 * y - 1;
+// the cluster, staging and key files only live as long as the program
+void removeClusterFile()
+{
+	if (clusterFile != NULL)
+		fclose(clusterFile);
+	if (stagingFile != NULL)
+		fclose(stagingFile);
+	if (keyFile != NULL)
+		fclose(keyFile);
+	clusterFile = NULL;
+	stagingFile = NULL;
+	keyFile = NULL;
+	remove(cluster_filename);
+	remove(staging_filename.c_str());
+	remove(key_filename.c_str());
+}
 
-	// camera coordinates
-	x = x * ASPECT_RATIO * FOV_FACTOR;
-	y = y * FOV_FACTOR;
+// create the cluster file, the staging file that loadScene streams triangles into
+// and the key file for sorting them, replacing existing files
+void openClusterFile()
+{
+	staging_filename = std::string(cluster_filename) + ".load";
+	key_filename = std::string(cluster_filename) + ".keys";
+	clusterFile = fopen(cluster_filename, "w+b");
+	stagingFile = fopen(staging_filename.c_str(), "w+b");
+	keyFile = fopen(key_filename.c_str(), "w+b");
+	if (clusterFile == NULL || stagingFile == NULL || keyFile == NULL)
+	{
+		printf("cannot open cluster file %s\n", cluster_filename);
+		exit(0);
+	}
+	atexit(removeClusterFile);
+}
 
-	glm::highp_dvec3 endPt = { x, y, -1.0 };
-	glm::highp_dvec3 dir = glm::normalize(endPt);
+void addClusterTriangle(const Triangle & t)
+{
+	if (fwrite(&t, sizeof(Triangle), 1, stagingFile) != 1)
+	{
+		printf("cannot write %s\n", staging_filename.c_str());
+		exit(0);
+	}
 
-	return Ray(startPt, dir);
+	Bounds bounds = triangleBounds(t);
+	glm::highp_dvec3 centroid = (bounds.min + bounds.max) * 0.5;
+	centroidBounds.min = glm::min(centroidBounds.min, centroid);
+	centroidBounds.max = glm::max(centroidBounds.max, centroid);
+	num_triangles++;
 }
 
-// send 5 rays from camera to each pixel for antialiasing
-std::vector<Ray> cameraRaysAA(double _x, double _y)
+// spread the lower 21 bits of v so there are two zero bits between each of them
+unsigned long long expandBits(unsigned long long v)
 {
-	std::vector<Ray> AARays;
-	double x, y;
-	glm::highp_dvec3 startPt = { 0.0, 0.0, 0.0 };
+	v &= 0x1fffff;
+	v = (v | (v << 32)) & 0x1f00000000ffffULL;
+	v = (v | (v << 16)) & 0x1f0000ff0000ffULL;
+	v = (v | (v << 8)) & 0x100f00f00f00f00fULL;
+	v = (v | (v << 4)) & 0x10c30c30c30c30c3ULL;
+	v = (v | (v << 2)) & 0x1249249249249249ULL;
+	return v;
+}
 
-	// ray0
-	// normalized device coordinates
-	x = (_x + 0.25) / WIDTH;
-	y = (_y + 0.25) / HEIGHT;
+// 63-bit Morton code of a point inside centroidBounds
+unsigned long long mortonCode(glm::highp_dvec3 p)
+{
+	glm::highp_dvec3 extent = glm::max(centroidBounds.max - centroidBounds.min, glm::highp_dvec3(1e-30));
+	glm::highp_dvec3 q = glm::clamp((p - centroidBounds.min) / extent, 0.0, 1.0) * 2097151.0;
+	return (expandBits((unsigned long long)q.x) << 2) | (expandBits((unsigned long long)q.y) << 1) | expandBits((unsigned long long)q.z);
+}
 
-	// screen coordinates
-	x = 2 * x - 1;
-	y = 2 * y - 1;
+void readStaged(long long index, Triangle * triangles, size_t count)
+{
+	fseeko(stagingFile, index * (long long)sizeof(Triangle), SEEK_SET);
+	if (fread(triangles, sizeof(Triangle), count, stagingFile) != count)
+	{
+		printf("cannot read %s\n", staging_filename.c_str());
+		exit(0);
+	}
+}
 
-	// camera coordinates
-	x = x * ASPECT_RATIO * FOV_FACTOR;
-	y = y * FOV_FACTOR;
+// Morton order, ties broken by load order so the clusters do not depend on the sort
+bool keyLess(const TriangleKey & a, const TriangleKey & b)
+{
+	return a.code < b.code || (a.code == b.code && a.index < b.index);
+}
 
-	glm::highp_dvec3 endPt0 = { x, y, -1.0 };
-	glm::highp_dvec3 dir0 = glm::normalize(endPt0);
-	Ray ray0(startPt, dir0);
-	AARays.push_back(ray0);
+void refillRun(KeyRun & run, size_t size)
+{
+	size_t count = (size_t)std::min((long long)size, run.end - run.next);
+	run.keys.resize(count);
+	run.pos = 0;
+	fseeko(keyFile, run.next * (long long)sizeof(TriangleKey), SEEK_SET);
+	if (fread(&run.keys[0], sizeof(TriangleKey), count, keyFile) != count)
+	{
+		printf("cannot read %s\n", key_filename.c_str());
+		exit(0);
+	}
+	run.next += count;
+}
 
-	// ray1
-	// normalized device coordinates
-	x = (_x + 0.25) / WIDTH;
-	y = (_y + 0.75) / HEIGHT;
+// build the hierarchy over clusters [first, first + count), which are in Morton order
+// returns the index of the node
+int buildClusterTree(const std::vector<Bounds> & bounds, int first, int count)
+{
+	int index = (int)clusterNodes.size();
+	clusterNodes.push_back(ClusterNode());
 
-	// screen coordinates
-	x = 2 * x - 1;
-	y = 2 * y - 1;
+	if (count == 1)
+	{
+		ClusterNode leaf = { bounds[first], -1, -1, first };
+		clusterNodes[index] = leaf;
+		return index;
+	}
 
-	// camera coordinates
-	x = x * ASPECT_RATIO * FOV_FACTOR;
-	y = y * FOV_FACTOR;
+	int left = buildClusterTree(bounds, first, count / 2);
+	int right = buildClusterTree(bounds, first + count / 2, count - count / 2);
+	ClusterNode node = { boundsUnion(clusterNodes[left].bounds, clusterNodes[right].bounds), left, right, -1 };
+	clusterNodes[index] = node;
+	return index;
+}
 
-	glm::highp_dvec3 endPt1 = { x, y, -1.0 };
-	glm::highp_dvec3 dir1 = glm::normalize(endPt1);
-	Ray ray1(startPt, dir1);
-	AARays.push_back(ray1);
+// sort the staged triangles into clusters, build the hierarchy and set up the cache
+// the Morton codes are sorted externally: each chunk of triangles gives a sorted run in
+// the key file, and the runs are merged while the clusters are written, so loading also
+// stays within cluster_cache_mb apart from the cluster bounds and the hierarchy
+// at least 2 slots are needed, one cluster stays pinned while shadow rays page in others
+void closeClusterFile()
+{
+	size_t clusterBytes = CLUSTER_SIZE * sizeof(Triangle);
+	size_t numSlots = ((size_t)cluster_cache_mb << 20) / clusterBytes;
+	numSlots = std::max(numSlots, (size_t)2);
+
+	// a chunk of triangles, their keys and the merge buffers share the cache budget
+	size_t chunkSize = ((size_t)cluster_cache_mb << 20) / (sizeof(Triangle) + 2 * sizeof(TriangleKey));
+	chunkSize = std::max(chunkSize / CLUSTER_SIZE, (size_t)1) * CLUSTER_SIZE;
+
+	// one sorted run of Morton codes per chunk
+	std::vector<Triangle> chunk(chunkSize);
+	std::vector<TriangleKey> keys(chunkSize);
+	int numRuns = 0;
+	for (int first = 0; first < num_triangles; first += (int)chunkSize)
+	{
+		int count = std::min((int)chunkSize, num_triangles - first);
+		readStaged(first, &chunk[0], count);
+		for (int k = 0; k < count; k++)
+		{
+			Bounds bounds = triangleBounds(chunk[k]);
+			keys[k].code = mortonCode((bounds.min + bounds.max) * 0.5);
+			keys[k].index = first + k;
+		}
+		std::sort(keys.begin(), keys.begin() + count, keyLess);
+		if (fwrite(&keys[0], sizeof(TriangleKey), count, keyFile) != (size_t)count)
+		{
+			printf("cannot write %s\n", key_filename.c_str());
+			exit(0);
+		}
+		numRuns++;
+	}
+	fflush(keyFile);
 
-	// ray2
-	// normalized device coordinates
-	x = (_x + 0.75) / WIDTH;
-	y = (_y + 0.25) / HEIGHT;
+	// merge the runs with a heap ordered by their current keys
+	size_t runSize = std::max(chunkSize / std::max(numRuns, 1), (size_t)1);
+	std::vector<KeyRun> runs(numRuns);
+	std::vector<int> heap;
+	for (int r = 0; r < numRuns; r++)
+	{
+		runs[r].next = (long long)r * chunkSize;
+		runs[r].end = std::min(runs[r].next + (long long)chunkSize, (long long)num_triangles);
+		refillRun(runs[r], runSize);
+		heap.push_back(r);
+	}
+	auto heapOrder = [&](int a, int b)
+	{
+		return keyLess(runs[b].keys[runs[b].pos], runs[a].keys[runs[a].pos]);
+	};
+	std::make_heap(heap.begin(), heap.end(), heapOrder);
+
+	// gather the triangles in Morton order a chunk at a time, reading the staging file
+	// in increasing order within a chunk, and write them out as clusters
+	num_clusters = (num_triangles + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+	std::vector<Bounds> bounds(num_clusters);
+	std::vector<Triangle> span(CLUSTER_SIZE);
+	for (int first = 0; first < num_triangles; first += (int)chunkSize)
+	{
+		int count = std::min((int)chunkSize, num_triangles - first);
 
-	// screen coordinates
-	x = 2 * x - 1;
-	y = 2 * y - 1;
+		// the next keys of the merge, reusing the code field for the position in the chunk
+		for (int k = 0; k < count; k++)
+		{
+			std::pop_heap(heap.begin(), heap.end(), heapOrder);
+			KeyRun & run = runs[heap.back()];
+			keys[k].index = run.keys[run.pos].index;
+			keys[k].code = k;
 
-	// camera coordinates
-	x = x * ASPECT_RATIO * FOV_FACTOR;
-	y = y * FOV_FACTOR;
+			if (++run.pos == run.keys.size())
+			{
+				if (run.next == run.end)
+				{
+					heap.pop_back();
+					continue;
+				}
+				refillRun(run, runSize);
+			}
+			std::push_heap(heap.begin(), heap.end(), heapOrder);
+		}
+		std::sort(keys.begin(), keys.begin() + count, [](const TriangleKey & a, const TriangleKey & b)
+		{
+			return a.index < b.index;
+		});
 
-	glm::highp_dvec3 endPt2 = { x, y, -1.0 };
-	glm::highp_dvec3 dir2 = glm::normalize(endPt2);
-	Ray ray2(startPt, dir2);
-	AARays.push_back(ray2);
+		// read triangles that are next to each other in the staging file at once
+		for (int k = 0; k < count;)
+		{
+			int n = 1;
+			while (k + n < count && n < CLUSTER_SIZE && keys[k + n].index == keys[k].index + n)
+				n++;
+			readStaged(keys[k].index, &span[0], n);
+			for (int i = 0; i < n; i++)
+				chunk[keys[k + i].code] = span[i];
+			k += n;
+		}
 
-	// ray3
-	// normalized device coordinates
-	x = (_x + 0.75) / WIDTH;
-	y = (_y + 0.75) / HEIGHT;
+		for (int k = 0; k < count; k += CLUSTER_SIZE)
+		{
+			int c = (first + k) / CLUSTER_SIZE;
+			int size = std::min(CLUSTER_SIZE, count - k);
+			bounds[c] = triangleBounds(chunk[k]);
+			for (int i = 1; i < size; i++)
+				bounds[c] = boundsUnion(bounds[c], triangleBounds(chunk[k + i]));
+
+			// every cluster takes a full CLUSTER_SIZE record so it can be found by index
+			if (fwrite(&chunk[k], sizeof(Triangle), CLUSTER_SIZE, clusterFile) != CLUSTER_SIZE)
+			{
+				printf("cannot write cluster file %s\n", cluster_filename);
+				exit(0);
+			}
+		}
+	}
+	fflush(clusterFile);
+
+	fclose(stagingFile);
+	fclose(keyFile);
+	stagingFile = NULL;
+	keyFile = NULL;
+	remove(staging_filename.c_str());
+	remove(key_filename.c_str());
+	std::vector<TriangleKey>().swap(keys);
+	std::vector<Triangle>().swap(chunk);
+	std::vector<Triangle>().swap(span);
+	std::vector<KeyRun>().swap(runs);
+
+	if (num_clusters > 0)
+		buildClusterTree(bounds, 0, num_clusters);
+
+	numSlots = std::min(numSlots, std::max((size_t)num_clusters, (size_t)2));
+	ClusterSlot empty = { -1, 0, 0 };
+	cacheSlots.assign(numSlots, empty);
+	cacheMemory.resize(numSlots * CLUSTER_SIZE);
+	clusterSlots.assign(num_clusters, -1);
+
+	printf("%d triangles in %d clusters of %d (%.1f MB on disk) under %d tree nodes, cache holds %d clusters (%.1f MB)\n",
+		num_triangles, num_clusters, CLUSTER_SIZE, num_clusters * clusterBytes / 1048576.0, (int)clusterNodes.size(),
+		(int)numSlots, numSlots * clusterBytes / 1048576.0);
+}
 
-	// screen coordinates
-	x = 2 * x - 1;
-	y = 2 * y - 1;
+// page in cluster c if needed and keep it resident until unpinCluster
+const Triangle * pinCluster(int c)
+{
+	int slot = clusterSlots[c];
+	if (slot >= 0)
+		clusterStats.hits++;
+	else
+	{
+		// evict the least recently used cluster that is not pinned
+		for (int s = 0; s < (int)cacheSlots.size(); s++)
+		{
+			if (cacheSlots[s].pins == 0 && (slot < 0 || cacheSlots[s].lastUse < cacheSlots[slot].lastUse))
+				slot = s;
+		}
+		if (slot < 0)
+		{
+			printf("cluster cache is too small, all clusters are pinned\n");
+			exit(0);
+		}
+		if (cacheSlots[slot].cluster >= 0)
+		{
+			clusterSlots[cacheSlots[slot].cluster] = -1;
+			clusterStats.evictions++;
+		}
 
-	// camera coordinates
-	x = x * ASPECT_RATIO * FOV_FACTOR;
-	y = y * FOV_FACTOR;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		fseeko(clusterFile, (long long)c * CLUSTER_SIZE * sizeof(Triangle), SEEK_SET);
+		if (fread(&cacheMemory[slot * CLUSTER_SIZE], sizeof(Triangle), CLUSTER_SIZE, clusterFile) != CLUSTER_SIZE)
+		{
+			printf("cannot read cluster %d from %s\n", c, cluster_filename);
+			exit(0);
+		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		clusterStats.faults++;
+		clusterStats.bytesRead += CLUSTER_SIZE * sizeof(Triangle);
+		clusterStats.ioSeconds += elapsed.count();
+
+		cacheSlots[slot].cluster = c;
+		clusterSlots[c] = slot;
+	}
+
+	cacheSlots[slot].pins++;
+	cacheSlots[slot].lastUse = ++cacheClock;
+	return &cacheMemory[slot * CLUSTER_SIZE];
+}
+
+void unpinCluster(int c)
+{
+	cacheSlots[clusterSlots[c]].pins--;
+}
+
+void print_cluster_stats()
+{
+	printf("Cluster cache: %lld page faults, %lld hits, %lld evictions, %.1f MB read in %.2f s\n",
+		clusterStats.faults, clusterStats.hits, clusterStats.evictions,
+		clusterStats.bytesRead / 1048576.0, clusterStats.ioSeconds);
+	fflush(stdout);
+}
+
+// call visit(triangle, index) for the triangles a ray may hit closer than maxDistance,
+// until visit returns false; visit may lower maxDistance, e.g. to the closest hit so far
+// in out-of-core mode the hierarchy is traversed front to back and only the clusters
+// the ray reaches within maxDistance are paged in
+template <typename Visitor>
+void forEachTriangle(const Ray & ray, double & maxDistance, Visitor visit)
+{
+	if (!out_of_core)
+	{
+		for (int i = 0; i < num_triangles; i++)
+		{
+			if (!visit(triangles[i], i))
+				return;
+		}
+		return;
+	}
 
-	glm::highp_dvec3 endPt3 = { x, y, -1.0 };
-	glm::highp_dvec3 dir3 = glm::normalize(endPt3);
-	Ray ray3(startPt, dir3);
-	AARays.push_back(ray3);
+	if (clusterNodes.empty())
+		return;
 
-	// ray4
+	// nodes to visit with the distance at which the ray enters them
+	std::pair<int, double> stack[128];
+	int top = 0;
+	double entry;
+	if (ray.boxIntersect(clusterNodes[0].bounds, maxDistance, entry))
+		stack[top++] = std::make_pair(0, entry);
+
+	while (top > 0)
+	{
+		std::pair<int, double> item = stack[--top];
+		if (item.second > maxDistance)
+			continue;
+
+		const ClusterNode & node = clusterNodes[item.first];
+		if (node.cluster >= 0)
+		{
+			int c = node.cluster;
+			const Triangle * cluster = pinCluster(c);
+			int count = std::min(CLUSTER_SIZE, num_triangles - c * CLUSTER_SIZE);
+			bool more = true;
+			for (int k = 0; k < count && more; k++)
+				more = visit(cluster[k], c * CLUSTER_SIZE + k);
+			unpinCluster(c);
+
+			if (!more)
+				return;
+			continue;
+		}
+
+		// push the farther child first so the nearer one is visited first
+		double leftEntry, rightEntry;
+		bool hitLeft = ray.boxIntersect(clusterNodes[node.left].bounds, maxDistance, leftEntry);
+		bool hitRight = ray.boxIntersect(clusterNodes[node.right].bounds, maxDistance, rightEntry);
+		if (hitLeft && hitRight && leftEntry < rightEntry)
+		{
+			stack[top++] = std::make_pair(node.right, rightEntry);
+			stack[top++] = std::make_pair(node.left, leftEntry);
+		}
+		else
+		{
+			if (hitLeft)
+				stack[top++] = std::make_pair(node.left, leftEntry);
+			if (hitRight)
+				stack[top++] = std::make_pair(node.right, rightEntry);
+		}
+	}
+}
+
+// sub-pixel sample position, (0.5, 0.5) is the pixel center
+struct SampleOffset
+{
+	double x, y;
+};
+
+// sub-pixel sampling patterns
+// quincunx: the 4 corners of a 2x2 grid and the center (5 samples)
+// grid: n x n regular grid
+// rotated grid: n x n grid sheared so every sample has its own row and column
+// halton: n points of the base 2/3 Halton sequence
+enum SamplePattern { PATTERN_QUINCUNX, PATTERN_GRID, PATTERN_ROTATED_GRID, PATTERN_HALTON };
+
+// radical inverse of i in the given base
+constexpr double radicalInverse(int base, int i)
+{
+	return (i == 0) ? 0.0 : ((i % base) + radicalInverse(base, i / base)) / base;
+}
+
+// number of samples of a pattern of size n
+constexpr int patternSamples(SamplePattern pattern, int n)
+{
+	return (pattern == PATTERN_QUINCUNX) ? 5 : ((pattern == PATTERN_HALTON) ? n : n * n);
+}
+
+// position of sample i of a pattern of size n
+constexpr SampleOffset sampleOffset(SamplePattern pattern, int n, int i)
+{
+	return (pattern == PATTERN_QUINCUNX) ?
+			((i == 4) ? SampleOffset{ 0.5, 0.5 } : SampleOffset{ 0.25 + 0.5 * (i / 2), 0.25 + 0.5 * (i % 2) }) :
+		(pattern == PATTERN_GRID) ?
+			SampleOffset{ ((i % n) + 0.5) / n, ((i / n) + 0.5) / n } :
+		(pattern == PATTERN_ROTATED_GRID) ?
+			SampleOffset{ ((i % n) + ((i / n) + 0.5) / n) / n, ((i / n) + (n - 1 - (i % n) + 0.5) / n) / n } :
+		SampleOffset{ radicalInverse(2, i + 1), radicalInverse(3, i + 1) };
+}
+
+// offset table of a pattern, generated at compile time
+template <SamplePattern P, int N, typename Indices = std::make_integer_sequence<int, patternSamples(P, N)>>
+struct SampleTable;
+
+template <SamplePattern P, int N, int... I>
+struct SampleTable<P, N, std::integer_sequence<int, I...>>
+{
+	static constexpr int count = sizeof...(I);
+	static constexpr SampleOffset offsets[count] = { sampleOffset(P, N, I)... };
+};
+
+template <SamplePattern P, int N, int... I>
+constexpr SampleOffset SampleTable<P, N, std::integer_sequence<int, I...>>::offsets[];
+
+// the samples traced for each pixel
+struct SampleSet
+{
+	const SampleOffset * offsets;
+	int count;
+};
+
+template <SamplePattern P, int N>
+SampleSet sampleSet()
+{
+	SampleSet set = { SampleTable<P, N>::offsets, SampleTable<P, N>::count };
+	return set;
+}
+
+// look up the table of a pattern, common sizes are generated at compile time
+// and other sizes are generated once here
+SampleSet samplePattern(SamplePattern pattern, int n)
+{
+	switch (pattern)
+	{
+	case PATTERN_QUINCUNX:
+		return sampleSet<PATTERN_QUINCUNX, 0>();
+	case PATTERN_GRID:
+		if (n == 1)
+			return sampleSet<PATTERN_GRID, 1>();
+		if (n == 2)
+			return sampleSet<PATTERN_GRID, 2>();
+		if (n == 3)
+			return sampleSet<PATTERN_GRID, 3>();
+		if (n == 4)
+			return sampleSet<PATTERN_GRID, 4>();
+		break;
+	case PATTERN_ROTATED_GRID:
+		if (n == 2)
+			return sampleSet<PATTERN_ROTATED_GRID, 2>();
+		if (n == 3)
+			return sampleSet<PATTERN_ROTATED_GRID, 3>();
+		if (n == 4)
+			return sampleSet<PATTERN_ROTATED_GRID, 4>();
+		break;
+	case PATTERN_HALTON:
+		if (n == 4)
+			return sampleSet<PATTERN_HALTON, 4>();
+		if (n == 8)
+			return sampleSet<PATTERN_HALTON, 8>();
+		if (n == 16)
+			return sampleSet<PATTERN_HALTON, 16>();
+		if (n == 32)
+			return sampleSet<PATTERN_HALTON, 32>();
+		break;
+	}
+
+	static SampleOffset generated[MAX_SAMPLES];
+	SampleSet set = { generated, patternSamples(pattern, n) };
+	for (int i = 0; i < set.count; i++)
+		generated[i] = sampleOffset(pattern, n, i);
+	return set;
+}
+
+// antialiasing pattern, chosen with -samples
+SamplePattern sample_pattern = PATTERN_QUINCUNX;
+int sample_size = 0;
+SampleSet pixelSamples;
+
+// a single sample through the pixel center
+const SampleSet centerSample = sampleSet<PATTERN_GRID, 1>();
+
+// send a ray from camera through a sample position of a pixel
+Ray cameraRay(double _x, double _y, const SampleOffset & offset)
+{
+	glm::highp_dvec3 startPt = { 0.0, 0.0, 0.0 };
+
+	double x, y;
 	// normalized device coordinates
-	x = (_x + 0.5) / WIDTH;
-	y = (_y + 0.5) / HEIGHT;
+	x = (_x + offset.x) / WIDTH;
+	y = (_y + offset.y) / HEIGHT;
 
 	// screen coordinates
 	x = 2 * x - 1;
@@ -319,12 +931,17 @@ std::vector<Ray> cameraRaysAA(double _x, double _y)
 	x = x * ASPECT_RATIO * FOV_FACTOR;
 	y = y * FOV_FACTOR;
 
-	glm::highp_dvec3 endPt4 = { x, y, -1.0 };
-	glm::highp_dvec3 dir4 = glm::normalize(endPt4);
-	Ray ray4(startPt, dir4);
-	AARays.push_back(ray4);
+	glm::highp_dvec3 endPt = { x, y, -1.0 };
+	glm::highp_dvec3 dir = glm::normalize(endPt);
+
+	return Ray(startPt, dir);
+}
 
-	return AARays;
+// send a ray from camera through every sample of a pixel, rays must hold samples.count rays
+void cameraRays(double _x, double _y, const SampleSet & samples, Ray * rays)
+{
+	for (int i = 0; i < samples.count; i++)
+		rays[i] = cameraRay(_x, _y, samples.offsets[i]);
 }
 
 // apply Phong shading to triangle at ray intersection
@@ -436,78 +1053,236 @@ glm::highp_dvec3 spherePhong(Sphere sphere, glm::highp_dvec3 intersection, Light
 	return color;
 }
 
-// calculate color at every pixel
-glm::highp_dvec3 finalColor(Ray ray)
+// check if a point is in shadow by tracing a ray towards the light,
+// ignoring the triangle or sphere the point lies on
+bool isInShadow(glm::highp_dvec3 intersection, const Light & light, int skipTriangle, int skipSphere)
 {
-	glm::highp_dvec3 color = { 1.0, 1.0, 1.0 };
+	glm::highp_dvec3 lightPosition = { light.position[0], light.position[1], light.position[2] };
 
-	double closestZ = -1e10;
+	glm::highp_dvec3 direction = lightPosition - intersection;
+	Ray shadow(intersection, glm::normalize(direction));
+	pixelCost.shadowRays++;
 
-	// check intersection of ray with every triangle
-	for (int i = 0; i < num_triangles; i++)
+	// check for shadow by spheres
+	for (int k = 0; k < num_spheres; k++)
 	{
-		glm::highp_dvec3 intersection = { 0, 0, -1e-10 };
+		if (k == skipSphere)
+			continue;
+
+		glm::highp_dvec3 obstruction = { 0, 0, -1e-10 };
 
-		if (ray.triangleIntersect(triangles[i], intersection) && (intersection.z > closestZ))
+		pixelCost.intersections++;
+		if (shadow.sphereIntersect(spheres[k], obstruction))
 		{
-			closestZ = intersection.z;
-			color = glm::highp_dvec3(0.0, 0.0, 0.0);
+			if (glm::length(obstruction - intersection) < glm::length(lightPosition - intersection))
+				return true;
+		}
+	}
 
-			// check if triangle is in shadow at ray intersection
-			for (int j = 0; j < num_lights; j++)
-			{
-				bool isInShadow = false;
+	// check for shadow by triangles, only those between the point and the light matter
+	bool shadowed = false;
+	double lightDistance = glm::length(direction);
+	forEachTriangle(shadow, lightDistance, [&](const Triangle & triangle, int k)
+	{
+		if (k == skipTriangle)
+			return true;
 
-				glm::highp_dvec3 lightPosition = { lights[j].position[0], lights[j].position[1], lights[j].position[2] };
+		glm::highp_dvec3 obstruction = { 0, 0, -1e-10 };
 
-				glm::highp_dvec3 direction = lightPosition - intersection;
-				Ray shadow(intersection, glm::normalize(direction));
+		pixelCost.intersections++;
+		if (shadow.triangleIntersect(triangle, obstruction))
+		{
+			if (glm::length(obstruction - intersection) < glm::length(lightPosition - intersection))
+				shadowed = true;
+		}
+		return !shadowed;
+	});
+
+	return shadowed;
+}
+
+// direction from the center of a cube map through point (u, v) in [-1, 1] on a face
+// faces are ordered +x, -x, +y, -y, +z, -z
+glm::highp_dvec3 cubeFaceDirection(int face, double u, double v)
+{
+	int axis = face / 2;
+	glm::highp_dvec3 dir;
+	dir[axis] = (face % 2 == 0) ? 1.0 : -1.0;
+	dir[(axis + 1) % 3] = u;
+	dir[(axis + 2) % 3] = v;
+	return glm::normalize(dir);
+}
 
-				// check for shadow by other spheres
+// inverse of cubeFaceDirection: find the face hit by a direction and the (u, v) on it
+int cubeFace(glm::highp_dvec3 dir, double & u, double & v)
+{
+	glm::highp_dvec3 a = glm::abs(dir);
+	int axis = (a.x >= a.y && a.x >= a.z) ? 0 : ((a.y >= a.z) ? 1 : 2);
+	u = dir[(axis + 1) % 3] / a[axis];
+	v = dir[(axis + 2) % 3] / a[axis];
+	return 2 * axis + ((dir[axis] < 0.0) ? 1 : 0);
+}
+
+int cubeTexel(double u)
+{
+	int texel = (int)((u + 1.0) * 0.5 * shadow_map_resolution);
+	return std::min(std::max(texel, 0), shadow_map_resolution - 1);
+}
+
+// render the depth of the nearest primitive around light j into its cube map
+void buildShadowMap(int j)
+{
+	int res = shadow_map_resolution;
+	glm::highp_dvec3 lightPosition = { lights[j].position[0], lights[j].position[1], lights[j].position[2] };
+
+	std::vector<float> & depth = shadowMaps[j].depth;
+	depth.assign(6 * res * res, 1e30f);
+
+	for (int face = 0; face < 6; face++)
+	{
+		for (int y = 0; y < res; y++)
+		{
+			for (int x = 0; x < res; x++)
+			{
+				double u = 2.0 * (x + 0.5) / res - 1.0;
+				double v = 2.0 * (y + 0.5) / res - 1.0;
+				Ray ray(lightPosition, cubeFaceDirection(face, u, v));
+
+				double nearest = 1e30;
+				forEachTriangle(ray, nearest, [&](const Triangle & triangle, int)
+				{
+					glm::highp_dvec3 hit;
+					if (ray.triangleIntersect(triangle, hit))
+						nearest = std::min(nearest, glm::length(hit - lightPosition));
+					return true;
+				});
 				for (int k = 0; k < num_spheres; k++)
 				{
-					glm::highp_dvec3 obstruction = { 0, 0, -1e-10 };
-
-					if (shadow.sphereIntersect(spheres[k], obstruction))
-					{
-						if (glm::length(lightPosition - intersection) > glm::length(obstruction - intersection))
-						{
-							isInShadow = true;
-							break;
-						}
-					}
+					glm::highp_dvec3 hit;
+					if (ray.sphereIntersect(spheres[k], hit))
+						nearest = std::min(nearest, glm::length(hit - lightPosition));
 				}
 
-				// check for shadow by other triangles
-				for (int k = 0; k < num_triangles; k++)
-				{
-					glm::highp_dvec3 obstruction = { 0, 0, -1e-10 };
-
-					if (k != i && shadow.triangleIntersect(triangles[k], obstruction))
-					{
-						if (glm::length(lightPosition - intersection) > glm::length(obstruction - intersection))
-						{
-							isInShadow = true;
-							break;
-						}
-					}
-				}
+				depth[(face * res + y) * res + x] = (float)nearest;
+			}
+		}
+	}
+}
+
+// build the shadow maps of all lights, one light per thread at a time
+// the out-of-core cluster cache is not shared between threads, so it builds them one by one
+void buildShadowMaps()
+{
+	printf("Building %d shadow maps (%d x %d per face)\n", num_lights, shadow_map_resolution, shadow_map_resolution);
+
+	unsigned int numThreads = std::thread::hardware_concurrency();
+	if (numThreads == 0 || out_of_core)
+		numThreads = 1;
+	if (numThreads > (unsigned int)num_lights)
+		numThreads = num_lights;
+
+	std::atomic<int> nextLight(0);
+	std::vector<std::thread> workers;
+	for (unsigned int t = 0; t < numThreads; t++)
+	{
+		workers.push_back(std::thread([&nextLight]()
+		{
+			for (int j = nextLight++; j < num_lights; j = nextLight++)
+				buildShadowMap(j);
+		}));
+	}
+	for (unsigned int t = 0; t < workers.size(); t++)
+		workers[t].join();
+
+	printf("Shadow maps done\n");
+}
+
+// fraction of light j reaching a point according to its shadow map,
+// averaged over a (2 * pcf + 1)^2 texel neighbourhood
+double shadowMapVisibility(int j, glm::highp_dvec3 intersection)
+{
+	glm::highp_dvec3 lightPosition = { lights[j].position[0], lights[j].position[1], lights[j].position[2] };
+	glm::highp_dvec3 toPoint = intersection - lightPosition;
+
+	// the bias is given in texels, so it grows with the texel footprint at this distance
+	double distance = glm::length(toPoint);
+	distance -= shadow_map_bias * distance * 2.0 / shadow_map_resolution;
+
+	double u, v;
+	int face = cubeFace(toPoint, u, v);
+	int x = cubeTexel(u);
+	int y = cubeTexel(v);
+
+	int res = shadow_map_resolution;
+	const std::vector<float> & depth = shadowMaps[j].depth;
+
+	int lit = 0, taps = 0;
+	for (int dy = -shadow_map_pcf; dy <= shadow_map_pcf; dy++)
+	{
+		for (int dx = -shadow_map_pcf; dx <= shadow_map_pcf; dx++)
+		{
+			int sx = std::min(std::max(x + dx, 0), res - 1);
+			int sy = std::min(std::max(y + dy, 0), res - 1);
+			if (depth[(face * res + sy) * res + sx] >= distance)
+				lit++;
+			taps++;
+		}
+	}
+
+	return (double)lit / taps;
+}
+
+// fraction of light j reaching a point, using the shadow maps if enabled
+double lightVisibility(int j, glm::highp_dvec3 intersection, int skipTriangle, int skipSphere)
+{
+	if (shadow_maps)
+		return shadowMapVisibility(j, intersection);
+
+	return isInShadow(intersection, lights[j], skipTriangle, skipSphere) ? 0.0 : 1.0;
+}
+
+// calculate color at every pixel
+glm::highp_dvec3 finalColor(const Ray & ray)
+{
+	glm::highp_dvec3 color = { 1.0, 1.0, 1.0 };
+
+	double closestZ = -1e10;
+	double closestDistance = 1e30;
+
+	// check intersection of ray with every triangle
+	forEachTriangle(ray, closestDistance, [&](const Triangle & triangle, int i)
+	{
+		glm::highp_dvec3 intersection = { 0, 0, -1e-10 };
+
+		pixelCost.intersections++;
+		if (ray.triangleIntersect(triangle, intersection) && (intersection.z > closestZ))
+		{
+			closestZ = intersection.z;
+			closestDistance = glm::length(intersection - ray.origin());
+			color = glm::highp_dvec3(0.0, 0.0, 0.0);
+
+			// check if triangle is in shadow at ray intersection
+			for (int j = 0; j < num_lights; j++)
+			{
+				double visibility = lightVisibility(j, intersection, i, -1);
 
 				// if not in shadow, calculate color based on Phong lighting
-				if (!isInShadow)
+				if (visibility > 0.0)
 				{
-					color += trianglePhong(triangles[i], intersection, lights[j]);
+					color += visibility * trianglePhong(triangle, intersection, lights[j]);
 					color = clampColor(color);
 				}
 			}
 		}
-	}
+		return true;
+	});
 
 	// check intersection of ray with every sphere
 	for (int i = 0; i < num_spheres; i++)
 	{
 		glm::highp_dvec3 intersection = { 0, 0, -1e-10 };
 
+		pixelCost.intersections++;
 		if (ray.sphereIntersect(spheres[i], intersection) && intersection.z > closestZ)
 		{
 			closestZ = intersection.z;
@@ -516,47 +1291,12 @@ glm::highp_dvec3 finalColor(Ray ray)
 			// check if sphere is in shadow at ray intersection
 			for (int j = 0; j < num_lights; j++)
 			{
-				bool isInShadow = false;
-
-				glm::highp_dvec3 lightPosition = { lights[j].position[0], lights[j].position[1], lights[j].position[2] };
-
-				glm::highp_dvec3 direction = lightPosition - intersection;
-				Ray shadow(intersection, glm::normalize(direction));
-
-				// check for shadow by other spheres
-				for (int k = 0; k < num_spheres; k++)
-				{
-					glm::highp_dvec3 obstruction = { 0, 0, -1e-10 };
-
-					if (k != i && shadow.sphereIntersect(spheres[k], obstruction))
-					{
-						if (glm::length(obstruction - intersection) < glm::length(lightPosition - intersection))
-						{
-							isInShadow = true;
-							break;
-						}
-					}
-				}
-
-				// check for shadow by other triangles
-				for (int k = 0; k < num_triangles; k++)
-				{
-					glm::highp_dvec3 obstruction = { 0, 0, -1e-10 };
-
-					if (shadow.triangleIntersect(triangles[k], obstruction))
-					{
-						if (glm::length(obstruction - intersection) < glm::length(lightPosition - intersection))
-						{
-							isInShadow = true;
-							break;
-						}
-					}
-				}
+				double visibility = lightVisibility(j, intersection, -1, i);
 
 				// if not in shadow, calculate color based on Phong lighting
-				if (!isInShadow)
+				if (visibility > 0.0)
 				{
-					color += spherePhong(spheres[i], intersection, lights[j]);
+					color += visibility * spherePhong(spheres[i], intersection, lights[j]);
 					color = clampColor(color);
 				}
 			}
@@ -571,6 +1311,27 @@ glm::highp_dvec3 finalColor(Ray ray)
 	return color;
 }
 
+// trace the rays of pixel (x, y) and average their colors
+// the work done is left in pixelCost
+glm::highp_dvec3 tracePixel(int x, int y, const SampleSet & samples)
+{
+	Ray rays[MAX_SAMPLES];
+	cameraRays(x, y, samples, rays);
+
+	pixelCost.intersections = 0;
+	pixelCost.shadowRays = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	glm::highp_dvec3 color(0.0);
+	for (int i = 0; i < samples.count; i++)
+		color += finalColor(rays[i]);
+	color /= (double)samples.count;
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	pixelCost.seconds = elapsed.count();
+	return color;
+}
+
 //MODIFY THIS FUNCTION
 void draw_scene()
 {
@@ -581,29 +1342,427 @@ void draw_scene()
 		glBegin(GL_POINTS);
 		for (unsigned int y = 0; y < HEIGHT; y++)
 		{
-			if (!antialiasing)
+			glm::highp_dvec3 color = tracePixel(x, y, pixelSamples);
+			plot_pixel(x, y, color.r * 255, color.g * 255, color.b * 255);
+			plot_cost(x, y);
+		}
+		glEnd();
+		glFlush();
+	}
+	printf("Done!\n");
+	fflush(stdout);
+}
+
+// split the image into tiles, sorted by distance of their center to the image center
+std::vector<Tile> centerOutTiles()
+{
+	std::vector<Tile> tiles;
+	for (int y = 0; y < HEIGHT; y += TILE_SIZE)
+	{
+		for (int x = 0; x < WIDTH; x += TILE_SIZE)
+		{
+			Tile tile = { x, y, std::min(x + TILE_SIZE, WIDTH), std::min(y + TILE_SIZE, HEIGHT) };
+			tiles.push_back(tile);
+		}
+	}
+
+	std::stable_sort(tiles.begin(), tiles.end(), [](const Tile & a, const Tile & b)
+	{
+		double ax = (a.x0 + a.x1 - WIDTH) * 0.5, ay = (a.y0 + a.y1 - HEIGHT) * 0.5;
+		double bx = (b.x0 + b.x1 - WIDTH) * 0.5, by = (b.y0 + b.y1 - HEIGHT) * 0.5;
+		return ax * ax + ay * ay < bx * bx + by * by;
+	});
+	return tiles;
+}
+
+// trace a tile into the buffer, one pixel per block of scale x scale pixels
+void render_tile(const Tile & tile, const QualityLevel & level)
+{
+	for (int y = tile.y0; y < tile.y1; y += level.scale)
+	{
+		for (int x = tile.x0; x < tile.x1; x += level.scale)
+		{
+			int x1 = std::min(x + level.scale, tile.x1);
+			int y1 = std::min(y + level.scale, tile.y1);
+			glm::highp_dvec3 color = tracePixel((x + x1) / 2, (y + y1) / 2, level.antialiasing ? pixelSamples : centerSample);
+
+			for (int by = y; by < y1; by++)
+				for (int bx = x; bx < x1; bx++)
+				{
+					plot_pixel_jpeg(bx, by, color.r * 255, color.g * 255, color.b * 255);
+					plot_cost(bx, by);
+				}
+		}
+	}
+}
+
+// show the buffer contents of a tile in the window
+void display_tile(const Tile & tile)
+{
+	glPointSize(2.0);
+	glBegin(GL_POINTS);
+	for (int y = tile.y0; y < tile.y1; y++)
+		for (int x = tile.x0; x < tile.x1; x++)
+			plot_pixel_display(x, y, buffer[y][x][0], buffer[y][x][1], buffer[y][x][2]);
+	glEnd();
+	glFlush();
+}
+
+// number of primary rays needed to trace the whole image at a quality level
+double levelRays(const QualityLevel & level)
+{
+	double blocks = ceil((double)WIDTH / level.scale) * ceil((double)HEIGHT / level.scale);
+	return blocks * (level.antialiasing ? pixelSamples.count : 1);
+}
+
+// fill the tiles from first on with the color and cost of the nearest of the tiles before them
+// used when the deadline hits before the cheapest level is complete
+void fill_untraced_tiles(const std::vector<Tile> & tiles, int first)
+{
+	for (int t = first; t < (int)tiles.size(); t++)
+	{
+		int nearest = 0;
+		double nearestDistance = 1e30;
+		for (int s = 0; s < first; s++)
+		{
+			double dx = (tiles[t].x0 + tiles[t].x1 - tiles[s].x0 - tiles[s].x1) * 0.5;
+			double dy = (tiles[t].y0 + tiles[t].y1 - tiles[s].y0 - tiles[s].y1) * 0.5;
+			if (dx * dx + dy * dy < nearestDistance)
 			{
-				Ray ray = cameraRay(x, y);
-				glm::highp_dvec3 color = finalColor(ray);
-				plot_pixel(x, y, color.r * 255, color.g * 255, color.b * 255);
+				nearestDistance = dx * dx + dy * dy;
+				nearest = s;
 			}
-			else
+		}
+
+		// tiles of the cheapest level have a single color and cost
+		unsigned char * color = buffer[tiles[nearest].y0][tiles[nearest].x0];
+		PixelCost cost = costBuffer[tiles[nearest].y0][tiles[nearest].x0];
+		for (int y = tiles[t].y0; y < tiles[t].y1; y++)
+			for (int x = tiles[t].x0; x < tiles[t].x1; x++)
+			{
+				plot_pixel_jpeg(x, y, color[0], color[1], color[2]);
+				costBuffer[y][x] = cost;
+			}
+		display_tile(tiles[t]);
+	}
+}
+
+// render within time_budget milliseconds
+// the quality levels are traced tile by tile, and the deadline is checked before
+// every tile except the first one; after each complete level, the best level
+// expected to fit in the remaining time is picked next
+void draw_scene_budget()
+{
+	typedef std::chrono::steady_clock Clock;
+	Clock::time_point start = Clock::now();
+	Clock::time_point deadline = start + std::chrono::milliseconds(time_budget);
+
+	int numLevels = sizeof(qualityLevels) / sizeof(qualityLevels[0]);
+	if (pixelSamples.count == 1)
+		numLevels--;
+
+	std::vector<Tile> tiles = centerOutTiles();
+
+	int reached = -1;
+	int partialLevel = -1;
+	int partialTiles = 0;
+	int next = 0;
+
+	while (next < numLevels)
+	{
+		Clock::time_point levelStart = Clock::now();
+
+		int done = 0;
+		for (; done < (int)tiles.size(); done++)
+		{
+			// trace at least one tile so there is an image to return
+			if ((reached >= 0 || done > 0) && Clock::now() >= deadline)
+				break;
+			render_tile(tiles[done], qualityLevels[next]);
+			display_tile(tiles[done]);
+		}
+
+		if (done < (int)tiles.size())
+		{
+			partialLevel = next;
+			partialTiles = done;
+			if (reached < 0)
+				fill_untraced_tiles(tiles, done);
+			break;
+		}
+
+		reached = next;
+		std::chrono::duration<double> levelTime = Clock::now() - levelStart;
+		double secondsPerRay = levelTime.count() / levelRays(qualityLevels[reached]);
+
+		std::chrono::duration<double> remaining = deadline - Clock::now();
+		if (remaining.count() <= 0.0)
+			break;
+
+		// skip the levels in between if a better one is expected to finish in time
+		next = reached + 1;
+		for (int l = numLevels - 1; l > next; l--)
+		{
+			if (levelRays(qualityLevels[l]) * secondsPerRay <= remaining.count())
 			{
-				glm::highp_dvec3 color;
-				std::vector<Ray> AARays = cameraRaysAA(x, y);
-				for (int i = 0; i < 5; i++)
+				next = l;
+				break;
+			}
+		}
+	}
+
+	std::chrono::duration<double> elapsed = Clock::now() - start;
+	if (reached >= 0)
+		printf("Reached quality level %d (%s) in %.0f ms\n", reached, qualityLevels[reached].name, elapsed.count() * 1000.0);
+	else
+		printf("No quality level completed in %.0f ms, untraced tiles were filled from their neighbours\n", elapsed.count() * 1000.0);
+	if (partialLevel >= 0)
+		printf("Deadline hit with %d of %d tiles at level %d (%s)\n", partialTiles, (int)tiles.size(), partialLevel, qualityLevels[partialLevel].name);
+	fflush(stdout);
+}
+
+// checkpoint file: a header, one done flag per tile (in centerOutTiles order),
+// then the pixels of the done tiles, row by row
+#define CHECKPOINT_VERSION 1
+
+struct CheckpointHeader
+{
+	char magic[8];
+	unsigned int version;
+	unsigned int width, height;
+	unsigned int tileSize, numTiles;
+	unsigned long long sceneHash;
+	unsigned long long settingsHash;
+};
+
+struct Checkpoint
+{
+	CheckpointHeader header;
+	std::vector<unsigned char> done;
+	std::vector<unsigned char> pixels;
+};
+
+std::thread checkpointWriter;
+std::atomic<bool> checkpointWriting(false);
+
+// 64-bit FNV-1a
+unsigned long long hashBytes(const void * data, size_t size, unsigned long long hash = 14695981039346656037ULL)
+{
+	const unsigned char * bytes = (const unsigned char *)data;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+unsigned long long sceneHash(const char * name)
+{
+	unsigned long long hash = hashBytes(NULL, 0);
+	FILE * file = fopen(name, "rb");
+	if (file == NULL)
+		return hash;
+
+	char chunk[65536];
+	size_t size;
+	while ((size = fread(chunk, 1, sizeof(chunk), file)) > 0)
+		hash = hashBytes(chunk, size, hash);
+	fclose(file);
+	return hash;
+}
+
+// hash of the settings that change the traced pixels
+unsigned long long settingsHash()
+{
+	unsigned long long hash = hashBytes(pixelSamples.offsets, pixelSamples.count * sizeof(SampleOffset));
+	hash = hashBytes(&shadow_maps, sizeof(shadow_maps), hash);
+	if (shadow_maps)
+	{
+		hash = hashBytes(&shadow_map_resolution, sizeof(shadow_map_resolution), hash);
+		hash = hashBytes(&shadow_map_bias, sizeof(shadow_map_bias), hash);
+		hash = hashBytes(&shadow_map_pcf, sizeof(shadow_map_pcf), hash);
+	}
+	return hash;
+}
+
+CheckpointHeader checkpointHeader(int numTiles)
+{
+	CheckpointHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "HW3CKPT", 8);
+	header.version = CHECKPOINT_VERSION;
+	header.width = WIDTH;
+	header.height = HEIGHT;
+	header.tileSize = TILE_SIZE;
+	header.numTiles = numTiles;
+	header.sceneHash = sceneHash(scene_filename);
+	header.settingsHash = settingsHash();
+	return header;
+}
+
+// copy the done tiles out of the buffer
+void packCheckpoint(const CheckpointHeader & header, const std::vector<Tile> & tiles, const std::vector<unsigned char> & done, Checkpoint & checkpoint)
+{
+	checkpoint.header = header;
+	checkpoint.done = done;
+	checkpoint.pixels.clear();
+	for (size_t t = 0; t < tiles.size(); t++)
+	{
+		if (!done[t])
+			continue;
+		for (int y = tiles[t].y0; y < tiles[t].y1; y++)
+			checkpoint.pixels.insert(checkpoint.pixels.end(), &buffer[y][tiles[t].x0][0], &buffer[y][tiles[t].x1 - 1][3]);
+	}
+}
+
+// write to a temporary file first so an interrupted write leaves the last checkpoint intact
+bool writeCheckpoint(const Checkpoint & checkpoint)
+{
+	std::string temporary = std::string(checkpoint_filename) + ".tmp";
+	FILE * file = fopen(temporary.c_str(), "wb");
+	if (file == NULL)
+		return false;
+
+	bool written = fwrite(&checkpoint.header, sizeof(CheckpointHeader), 1, file) == 1
+		&& fwrite(&checkpoint.done[0], 1, checkpoint.done.size(), file) == checkpoint.done.size()
+		&& (checkpoint.pixels.empty() || fwrite(&checkpoint.pixels[0], 1, checkpoint.pixels.size(), file) == checkpoint.pixels.size());
+	written = (fclose(file) == 0) && written;
+	if (!written)
+		return false;
+
+#ifdef WIN32
+	remove(checkpoint_filename);
+#endif
+	return rename(temporary.c_str(), checkpoint_filename) == 0;
+}
+
+void writeCheckpointThread(Checkpoint checkpoint)
+{
+	if (!writeCheckpoint(checkpoint))
+		printf("Error in saving checkpoint %s\n", checkpoint_filename);
+	checkpointWriting = false;
+}
+
+// hand a snapshot of the done tiles to a background thread, unless the previous one is still being written
+void saveCheckpointAsync(const CheckpointHeader & header, const std::vector<Tile> & tiles, const std::vector<unsigned char> & done)
+{
+	if (checkpointWriting)
+		return;
+	if (checkpointWriter.joinable())
+		checkpointWriter.join();
+
+	Checkpoint checkpoint;
+	packCheckpoint(header, tiles, done, checkpoint);
+
+	checkpointWriting = true;
+	checkpointWriter = std::thread(writeCheckpointThread, std::move(checkpoint));
+}
+
+// restore the done tiles of a checkpoint into the buffer
+// returns false if there is no checkpoint, exits if it belongs to another scene or other settings
+bool loadCheckpoint(const CheckpointHeader & header, const std::vector<Tile> & tiles, std::vector<unsigned char> & done)
+{
+	FILE * file = fopen(checkpoint_filename, "rb");
+	if (file == NULL)
+		return false;
+
+	CheckpointHeader saved;
+	bool valid = fread(&saved, sizeof(CheckpointHeader), 1, file) == 1
+		&& memcmp(saved.magic, header.magic, 8) == 0 && saved.version == header.version;
+	if (!valid || saved.width != header.width || saved.height != header.height
+		|| saved.tileSize != header.tileSize || saved.numTiles != header.numTiles)
+	{
+		printf("checkpoint %s is not a checkpoint of a %d x %d render\n", checkpoint_filename, WIDTH, HEIGHT);
+		exit(0);
+	}
+	if (saved.sceneHash != header.sceneHash)
+	{
+		printf("checkpoint %s was made for a different scene file\n", checkpoint_filename);
+		exit(0);
+	}
+	if (saved.settingsHash != header.settingsHash)
+	{
+		printf("checkpoint %s was made with different sampling or shadow settings\n", checkpoint_filename);
+		exit(0);
+	}
+
+	bool complete = fread(&done[0], 1, done.size(), file) == done.size();
+	for (size_t t = 0; t < tiles.size() && complete; t++)
+	{
+		if (!done[t])
+			continue;
+		for (int y = tiles[t].y0; y < tiles[t].y1 && complete; y++)
+		{
+			size_t size = (tiles[t].x1 - tiles[t].x0) * 3;
+			complete = fread(&buffer[y][tiles[t].x0][0], 1, size, file) == size;
+		}
+	}
+	fclose(file);
+
+	if (!complete)
+	{
+		printf("checkpoint %s is truncated\n", checkpoint_filename);
+		exit(0);
+	}
+	return true;
+}
+
+// render all tiles at full quality, checkpointing every checkpoint_interval seconds
+// with -resume, the tiles found in the checkpoint are not traced again
+void draw_scene_checkpointed()
+{
+	typedef std::chrono::steady_clock Clock;
+	const QualityLevel fullQuality = { 1, true, "full quality" };
+
+	std::vector<Tile> tiles = centerOutTiles();
+	std::vector<unsigned char> done(tiles.size(), 0);
+	CheckpointHeader header = checkpointHeader((int)tiles.size());
+
+	if (resume)
+	{
+		if (loadCheckpoint(header, tiles, done))
+		{
+			int restored = 0;
+			for (size_t t = 0; t < tiles.size(); t++)
+			{
+				if (done[t])
 				{
-					Ray ray = AARays[i];
-					glm::highp_dvec3 rayColor = finalColor(ray);
-					color += rayColor;
+					display_tile(tiles[t]);
+					restored++;
 				}
-				color /= 5.0;
-				plot_pixel(x, y, color.r * 255, color.g * 255, color.b * 255);
 			}
+			printf("Resuming from %s with %d of %d tiles done\n", checkpoint_filename, restored, (int)tiles.size());
+		}
+		else
+			printf("No checkpoint %s, starting from scratch\n", checkpoint_filename);
+	}
+
+	Clock::time_point lastCheckpoint = Clock::now();
+	for (size_t t = 0; t < tiles.size(); t++)
+	{
+		if (done[t])
+			continue;
+
+		render_tile(tiles[t], fullQuality);
+		display_tile(tiles[t]);
+		done[t] = 1;
+
+		if (Clock::now() - lastCheckpoint >= std::chrono::seconds(checkpoint_interval))
+		{
+			saveCheckpointAsync(header, tiles, done);
+			lastCheckpoint = Clock::now();
 		}
-		glEnd();
-		glFlush();
 	}
+
+	// leave a complete checkpoint behind, so resuming a finished render does not trace again
+	if (checkpointWriter.joinable())
+		checkpointWriter.join();
+	Checkpoint checkpoint;
+	packCheckpoint(header, tiles, done, checkpoint);
+	if (!writeCheckpoint(checkpoint))
+		printf("Error in saving checkpoint %s\n", checkpoint_filename);
+
 	printf("Done!\n");
 	fflush(stdout);
 }
@@ -628,6 +1787,109 @@ void plot_pixel(int x, int y, unsigned char r, unsigned char g, unsigned char b)
 		plot_pixel_jpeg(x, y, r, g, b);
 }
 
+void plot_cost(int x, int y)
+{
+	costBuffer[y][x] = pixelCost;
+}
+
+// map t in [0, 1] to black - blue - cyan - green - yellow - red
+glm::highp_dvec3 heatColor(double t)
+{
+	static const glm::highp_dvec3 ramp[] =
+	{
+		glm::highp_dvec3(0.0, 0.0, 0.0),
+		glm::highp_dvec3(0.0, 0.0, 1.0),
+		glm::highp_dvec3(0.0, 1.0, 1.0),
+		glm::highp_dvec3(0.0, 1.0, 0.0),
+		glm::highp_dvec3(1.0, 1.0, 0.0),
+		glm::highp_dvec3(1.0, 0.0, 0.0),
+	};
+	const int last = sizeof(ramp) / sizeof(ramp[0]) - 1;
+
+	t = std::min(std::max(t, 0.0), 1.0) * last;
+	int i = std::min((int)t, last - 1);
+	return glm::mix(ramp[i], ramp[i + 1], t - i);
+}
+
+// write one cost metric as a false color image or, for HEATMAP_RAW, as a float PFM image
+// the false colors span 0 to the 99th percentile so a few outliers do not wash out the map
+void save_heatmap(const char * base, const char * metric, const std::vector<float> & values)
+{
+	const char * extension = (heatmap == HEATMAP_PNG) ? "png" : ((heatmap == HEATMAP_RAW) ? "pfm" : "ppm");
+	std::string name = std::string(base) + "_" + metric + "." + extension;
+
+	std::vector<float> sorted = values;
+	std::vector<float>::iterator percentile = sorted.begin() + sorted.size() * 99 / 100;
+	std::nth_element(sorted.begin(), percentile, sorted.end());
+	float range = *percentile;
+
+	float maximum = *std::max_element(values.begin(), values.end());
+	double total = 0.0;
+	for (size_t i = 0; i < values.size(); i++)
+		total += values[i];
+	printf("Saving %s heatmap: %s (mean %g, 99th percentile %g, max %g per pixel)\n", metric, name.c_str(), total / values.size(), range, maximum);
+
+	bool saved;
+	if (heatmap == HEATMAP_RAW)
+	{
+		// PFM rows go from bottom to top like the rows of the buffer, the scale sign gives the byte order
+		unsigned int one = 1;
+		bool littleEndian = *(unsigned char *)&one == 1;
+
+		FILE * file = fopen(name.c_str(), "wb");
+		saved = (file != NULL);
+		if (file)
+		{
+			fprintf(file, "Pf\n%d %d\n%s\n", WIDTH, HEIGHT, littleEndian ? "-1.0" : "1.0");
+			for (int y = 0; y < HEIGHT; y++)
+				saved = saved && fwrite(&values[y * WIDTH], sizeof(float), WIDTH, file) == WIDTH;
+			saved = (fclose(file) == 0) && saved;
+		}
+	}
+	else
+	{
+		std::vector<unsigned char> pixels(WIDTH * HEIGHT * 3);
+		for (size_t i = 0; i < values.size(); i++)
+		{
+			glm::highp_dvec3 color = heatColor(range > 0.0f ? values[i] / range : (values[i] > 0.0f ? 1.0 : 0.0));
+			pixels[3 * i + 0] = (unsigned char)(color.r * 255);
+			pixels[3 * i + 1] = (unsigned char)(color.g * 255);
+			pixels[3 * i + 2] = (unsigned char)(color.b * 255);
+		}
+
+		ImageIO img(WIDTH, HEIGHT, 3, &pixels[0]);
+		saved = img.save(name.c_str(), (heatmap == HEATMAP_PNG) ? ImageIO::FORMAT_PNG : ImageIO::FORMAT_PPM) == ImageIO::OK;
+	}
+
+	if (!saved)
+		printf("Error in Saving\n");
+}
+
+// save intersection tests, shadow rays and tracing time per pixel
+// next to the output image, or next to the scene file in display mode
+void save_heatmaps()
+{
+	std::string base = (mode == MODE_JPEG) ? filename : scene_filename;
+	size_t dot = base.find_last_of('.');
+	if (dot != std::string::npos && base.find_first_of("/\\", dot) == std::string::npos)
+		base.erase(dot);
+
+	std::vector<float> intersections(WIDTH * HEIGHT), shadowRays(WIDTH * HEIGHT), seconds(WIDTH * HEIGHT);
+	for (int y = 0; y < HEIGHT; y++)
+	{
+		for (int x = 0; x < WIDTH; x++)
+		{
+			intersections[y * WIDTH + x] = (float)costBuffer[y][x].intersections;
+			shadowRays[y * WIDTH + x] = (float)costBuffer[y][x].shadowRays;
+			seconds[y * WIDTH + x] = (float)costBuffer[y][x].seconds;
+		}
+	}
+
+	save_heatmap(base.c_str(), "intersections", intersections);
+	save_heatmap(base.c_str(), "shadowrays", shadowRays);
+	save_heatmap(base.c_str(), "time", seconds);
+}
+
 void save_jpg()
 {
 	printf("Saving JPEG file: %s\n", filename);
@@ -706,9 +1968,14 @@ int loadScene(char *argv)
 				parse_shi(file, &t.v[j].shininess);
 			}
 
+			if (out_of_core)
+			{
+				addClusterTriangle(t);
+				continue;
+			}
 			if (num_triangles == MAX_TRIANGLES)
 			{
-				printf("too many triangles, you should increase MAX_TRIANGLES!\n");
+				printf("too many triangles, you should increase MAX_TRIANGLES or use -outofcore!\n");
 				exit(0);
 			}
 			triangles[num_triangles++] = t;
@@ -773,9 +2040,18 @@ void idle()
 	static int once = 0;
 	if (!once)
 	{
-		draw_scene();
+		if (time_budget > 0)
+			draw_scene_budget();
+		else if (checkpoint_filename != NULL)
+			draw_scene_checkpointed();
+		else
+			draw_scene();
 		if (mode == MODE_JPEG)
 			save_jpg();
+		if (heatmap != HEATMAP_NONE)
+			save_heatmaps();
+		if (out_of_core)
+			print_cluster_stats();
 	}
 	once = 1;
 }
@@ -790,11 +2066,139 @@ void keyboardFunc(unsigned char key, int x, int y)
 	}
 }
 
+void usage(const char * program)
+{
+	printf("Usage: %s [options] <input scenefile> [output jpegname]\n", program);
+	printf("Options:\n");
+	printf("  -shadowmap <resolution>  approximate shadows with cube-map shadow maps of the given face size\n");
+	printf("  -shadowbias <bias>       depth bias for shadow map lookups in texels (default %g)\n", shadow_map_bias);
+	printf("  -pcf <radius>            percentage-closer filtering radius in texels (default %d)\n", shadow_map_pcf);
+	printf("  -budget <milliseconds>   render progressively and stop at the deadline with the best image so far\n");
+	printf("  -samples <pattern> [n]   antialiasing pattern: quincunx (default), grid <n>, rotated <n> (n x n samples)\n");
+	printf("                           or halton <n> (n samples), grid 1 turns antialiasing off\n");
+	printf("  -heatmap <ppm|png|raw>   save per-pixel intersection tests, shadow rays and tracing time\n");
+	printf("                           as false color images or float PFM images next to the output\n");
+	printf("  -outofcore <file> <MB>   keep triangles in clusters in the given file, with at most MB of them in memory\n");
+	printf("                           (the file is overwritten, and removed when the program exits)\n");
+	printf("  -checkpoint <file>       save the finished tiles to file while rendering\n");
+	printf("  -interval <seconds>      time between checkpoints (default %d)\n", checkpoint_interval);
+	printf("  -resume                  continue the render saved in the -checkpoint file\n");
+	exit(0);
+}
+
+// handle the options in argv and move the remaining arguments to the front
+// returns the new argument count
+int parse_options(int argc, char ** argv)
+{
+	int count = 1;
+	for (int i = 1; i < argc; i++)
+	{
+		if (argv[i][0] != '-')
+			argv[count++] = argv[i];
+		else if (strcasecmp(argv[i], "-shadowmap") == 0 && i + 1 < argc)
+		{
+			shadow_maps = true;
+			shadow_map_resolution = atoi(argv[++i]);
+			if (shadow_map_resolution <= 0)
+				usage(argv[0]);
+		}
+		else if (strcasecmp(argv[i], "-shadowbias") == 0 && i + 1 < argc)
+			shadow_map_bias = atof(argv[++i]);
+		else if (strcasecmp(argv[i], "-pcf") == 0 && i + 1 < argc)
+		{
+			shadow_map_pcf = atoi(argv[++i]);
+			if (shadow_map_pcf < 0)
+				usage(argv[0]);
+		}
+		else if (strcasecmp(argv[i], "-budget") == 0 && i + 1 < argc)
+		{
+			time_budget = atoi(argv[++i]);
+			if (time_budget <= 0)
+				usage(argv[0]);
+		}
+		else if (strcasecmp(argv[i], "-samples") == 0 && i + 1 < argc)
+		{
+			i++;
+			if (strcasecmp(argv[i], "quincunx") == 0)
+				sample_pattern = PATTERN_QUINCUNX;
+			else if (strcasecmp(argv[i], "grid") == 0 && i + 1 < argc)
+				sample_pattern = PATTERN_GRID;
+			else if (strcasecmp(argv[i], "rotated") == 0 && i + 1 < argc)
+				sample_pattern = PATTERN_ROTATED_GRID;
+			else if (strcasecmp(argv[i], "halton") == 0 && i + 1 < argc)
+				sample_pattern = PATTERN_HALTON;
+			else
+				usage(argv[0]);
+
+			if (sample_pattern != PATTERN_QUINCUNX)
+			{
+				sample_size = atoi(argv[++i]);
+				if (sample_size <= 0 || patternSamples(sample_pattern, sample_size) > MAX_SAMPLES)
+					usage(argv[0]);
+			}
+		}
+		else if (strcasecmp(argv[i], "-heatmap") == 0 && i + 1 < argc)
+		{
+			i++;
+			if (strcasecmp(argv[i], "ppm") == 0)
+				heatmap = HEATMAP_PPM;
+			else if (strcasecmp(argv[i], "png") == 0)
+			{
+#ifndef ENABLE_PNG
+				printf("PNG heatmaps need ENABLE_PNG in imageFormats.h, use -heatmap ppm or raw\n");
+				exit(0);
+#endif
+				heatmap = HEATMAP_PNG;
+			}
+			else if (strcasecmp(argv[i], "raw") == 0)
+				heatmap = HEATMAP_RAW;
+			else
+				usage(argv[0]);
+		}
+		else if (strcasecmp(argv[i], "-outofcore") == 0 && i + 2 < argc)
+		{
+			out_of_core = true;
+			cluster_filename = argv[++i];
+			cluster_cache_mb = atoi(argv[++i]);
+			if (cluster_cache_mb <= 0)
+				usage(argv[0]);
+		}
+		else if (strcasecmp(argv[i], "-checkpoint") == 0 && i + 1 < argc)
+			checkpoint_filename = argv[++i];
+		else if (strcasecmp(argv[i], "-interval") == 0 && i + 1 < argc)
+		{
+			checkpoint_interval = atoi(argv[++i]);
+			if (checkpoint_interval <= 0)
+				usage(argv[0]);
+		}
+		else if (strcasecmp(argv[i], "-resume") == 0)
+			resume = true;
+		else
+			usage(argv[0]);
+	}
+	return count;
+}
+
 int main(int argc, char ** argv)
 {
+	argc = parse_options(argc, argv);
 	if ((argc < 2) || (argc > 3))
+		usage(argv[0]);
+	if (resume && checkpoint_filename == NULL)
+		usage(argv[0]);
+
+	// a budget render traces the tiles at several quality levels, while a checkpoint
+	// only records tiles at full quality
+	if (checkpoint_filename != NULL && time_budget > 0)
+	{
+		printf("-checkpoint cannot be used with -budget, a budget render does not trace every tile at full quality\n");
+		exit(0);
+	}
+
+	// the checkpoint only holds colors, tiles restored from it would have no cost data
+	if (resume && heatmap != HEATMAP_NONE)
 	{
-		printf("Usage: %s <input scenefile> [output jpegname]\n", argv[0]);
+		printf("-heatmap cannot be used with -resume, restored tiles have no cost data\n");
 		exit(0);
 	}
 	if (argc == 3)
@@ -805,9 +2209,18 @@ int main(int argc, char ** argv)
 	else if (argc == 2)
 		mode = MODE_DISPLAY;
 
+	pixelSamples = samplePattern(sample_pattern, sample_size);
+
+	scene_filename = argv[1];
+
 	glutInit(&argc, argv);
+	if (out_of_core)
+		openClusterFile();
 	loadScene(argv[1]);
-
+	if (out_of_core)
+		closeClusterFile();
+	if (shadow_maps)
+		buildShadowMaps();
 	glutInitDisplayMode(GLUT_RGBA | GLUT_SINGLE);
 	glutInitWindowPosition(0, 0);
 	glutInitWindowSize(WIDTH, HEIGHT);
@@ -0,0 +1,317 @@
+/* **************************
+ * CSCI 420
+ * Assignment 3 Raytracer
+ * Scene generator for scaling and stress tests
+ * Built by the Makefile only, it is not part of hw3.sln
+ * *************************
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cmath>
+#include <random>
+#ifdef WIN32
+#define strcasecmp _stricmp
+#endif
+
+#include <glm/glm.hpp>
+
+// limits of hw3, larger scenes need hw3 -outofcore for the triangles
+#define MAX_TRIANGLES 20000
+#define MAX_SPHERES 100
+#define MAX_LIGHTS 100
+
+// same camera as hw3: at the origin looking down -z with a 60 degree field of view
+#define ASPECT_RATIO (640.0 / 480.0)
+const double FOV_FACTOR = tan((60.0 / 2.0) * (3.1415926535 / 180.0));
+const double PI = 3.1415926535897932;
+
+// generated objects are placed between these depths
+#define NEAR_Z 5.0
+#define FAR_Z 50.0
+
+unsigned int seed = 1;
+long long num_random_triangles = 0;
+long long num_random_spheres = 0;
+long long num_tessellated = 0;
+int tessellation = 16;
+long long num_layers = 0;
+long long num_lights = 1;
+double object_size = 0.05;
+
+std::mt19937_64 rng;
+
+// uniform in [0, 1), the same on every platform for a given seed
+double random01()
+{
+	return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+double randomRange(double lo, double hi)
+{
+	return lo + (hi - lo) * random01();
+}
+
+// random point inside the view frustum between NEAR_Z and FAR_Z
+glm::dvec3 randomPoint()
+{
+	double depth = randomRange(NEAR_Z, FAR_Z);
+	double x = randomRange(-1.0, 1.0) * ASPECT_RATIO * FOV_FACTOR * depth;
+	double y = randomRange(-1.0, 1.0) * FOV_FACTOR * depth;
+	return glm::dvec3(x, y, -depth);
+}
+
+// the components are drawn one statement at a time, the order in which
+// function arguments are evaluated differs between compilers
+glm::dvec3 randomVector(double lo, double hi)
+{
+	double x = randomRange(lo, hi);
+	double y = randomRange(lo, hi);
+	double z = randomRange(lo, hi);
+	return glm::dvec3(x, y, z);
+}
+
+glm::dvec3 randomColor()
+{
+	return randomVector(0.1, 1.0);
+}
+
+void write_doubles(FILE * file, const char * label, glm::dvec3 p)
+{
+	fprintf(file, "%s %f %f %f\n", label, p.x, p.y, p.z);
+}
+
+void write_vertex(FILE * file, glm::dvec3 position, glm::dvec3 normal, glm::dvec3 diffuse, double shininess)
+{
+	write_doubles(file, "pos:", position);
+	write_doubles(file, "nor:", normal);
+	write_doubles(file, "dif:", diffuse);
+	write_doubles(file, "spe:", glm::dvec3(0.3, 0.3, 0.3));
+	fprintf(file, "shi: %f\n", shininess);
+}
+
+void write_triangle(FILE * file, const glm::dvec3 p[3], const glm::dvec3 n[3], glm::dvec3 diffuse, double shininess)
+{
+	fprintf(file, "triangle\n");
+	for (int j = 0; j < 3; j++)
+		write_vertex(file, p[j], n[j], diffuse, shininess);
+}
+
+// triangles of random shape and color, sized relative to their depth, facing the camera
+void write_random_triangles(FILE * file)
+{
+	for (long long i = 0; i < num_random_triangles; i++)
+	{
+		glm::dvec3 center = randomPoint();
+		double size = object_size * -center.z;
+
+		glm::dvec3 p[3];
+		for (int j = 0; j < 3; j++)
+			p[j] = center + size * randomVector(-1.0, 1.0);
+
+		glm::dvec3 normal = glm::cross(p[1] - p[0], p[2] - p[0]);
+		if (glm::length(normal) < 1e-12)
+			normal = glm::dvec3(0.0, 0.0, 1.0);
+		normal = glm::normalize(normal);
+		if (glm::dot(normal, center) > 0.0)
+			normal = -normal;
+
+		glm::dvec3 n[3] = { normal, normal, normal };
+		glm::dvec3 diffuse = randomColor();
+		double shininess = randomRange(1.0, 50.0);
+		write_triangle(file, p, n, diffuse, shininess);
+	}
+}
+
+void write_random_spheres(FILE * file)
+{
+	for (long long i = 0; i < num_random_spheres; i++)
+	{
+		glm::dvec3 center = randomPoint();
+
+		fprintf(file, "sphere\n");
+		write_doubles(file, "pos:", center);
+		fprintf(file, "rad: %f\n", object_size * -center.z * randomRange(0.5, 1.5));
+		write_doubles(file, "dif:", randomColor());
+		write_doubles(file, "spe:", glm::dvec3(0.5, 0.5, 0.5));
+		fprintf(file, "shi: %f\n", randomRange(1.0, 50.0));
+	}
+}
+
+// point on the unit sphere at latitude step i and longitude step j
+glm::dvec3 spherePoint(int i, int j)
+{
+	double theta = PI * i / tessellation;
+	double phi = 2.0 * PI * j / tessellation;
+	return glm::dvec3(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+}
+
+// spheres made of 2 * tessellation * (tessellation - 1) triangles with smooth vertex normals
+// the quads touching a pole have two corners on it and take a single triangle
+void write_tessellated_spheres(FILE * file)
+{
+	for (long long s = 0; s < num_tessellated; s++)
+	{
+		glm::dvec3 center = randomPoint();
+		double radius = object_size * -center.z * randomRange(0.5, 1.5);
+		glm::dvec3 diffuse = randomColor();
+		double shininess = randomRange(1.0, 50.0);
+
+		for (int i = 0; i < tessellation; i++)
+		{
+			for (int j = 0; j < tessellation; j++)
+			{
+				glm::dvec3 quad[4] = { spherePoint(i, j), spherePoint(i + 1, j), spherePoint(i + 1, j + 1), spherePoint(i, j + 1) };
+				int corners[2][3] = { { 0, 1, 2 }, { 0, 2, 3 } };
+				int first = (i == tessellation - 1) ? 1 : 0;
+				int last = (i == 0) ? 1 : 2;
+
+				for (int t = first; t < last; t++)
+				{
+					glm::dvec3 p[3], n[3];
+					for (int k = 0; k < 3; k++)
+					{
+						n[k] = quad[corners[t][k]];
+						p[k] = center + radius * n[k];
+					}
+					write_triangle(file, p, n, diffuse, shininess);
+				}
+			}
+		}
+	}
+}
+
+// quads filling the whole view, written from far to near so that every one
+// of them is a new closest hit for each camera ray (worst case overdraw)
+void write_layers(FILE * file)
+{
+	for (long long l = 0; l < num_layers; l++)
+	{
+		double depth = (num_layers == 1) ? FAR_Z : FAR_Z - (FAR_Z - NEAR_Z) * l / (num_layers - 1);
+		double w = ASPECT_RATIO * FOV_FACTOR * depth * 1.01;
+		double h = FOV_FACTOR * depth * 1.01;
+
+		glm::dvec3 quad[4] = { glm::dvec3(-w, -h, -depth), glm::dvec3(w, -h, -depth), glm::dvec3(w, h, -depth), glm::dvec3(-w, h, -depth) };
+		glm::dvec3 normal(0.0, 0.0, 1.0);
+		glm::dvec3 n[3] = { normal, normal, normal };
+		glm::dvec3 diffuse = randomColor();
+		double shininess = randomRange(1.0, 50.0);
+
+		glm::dvec3 first[3] = { quad[0], quad[1], quad[2] };
+		glm::dvec3 second[3] = { quad[0], quad[2], quad[3] };
+		write_triangle(file, first, n, diffuse, shininess);
+		write_triangle(file, second, n, diffuse, shininess);
+	}
+}
+
+// lights around and above the generated objects, sharing a total intensity of 1
+void write_lights(FILE * file)
+{
+	for (long long i = 0; i < num_lights; i++)
+	{
+		double x = randomRange(-FAR_Z, FAR_Z);
+		double y = randomRange(0.0, FAR_Z);
+		double z = randomRange(-FAR_Z, 0.0);
+		glm::dvec3 position(x, y, z);
+		double intensity = 1.0 / num_lights;
+
+		fprintf(file, "light\n");
+		write_doubles(file, "pos:", position);
+		write_doubles(file, "col:", glm::dvec3(intensity, intensity, intensity));
+	}
+}
+
+void usage(const char * program)
+{
+	printf("Usage: %s [options] <output scenefile>\n", program);
+	printf("Options:\n");
+	printf("  -seed <n>                  random seed (default %u)\n", seed);
+	printf("  -triangles <n>             n random triangles\n");
+	printf("  -spheres <n>               n random spheres\n");
+	printf("  -tessellated <n> <steps>   n spheres of 2 * steps * (steps - 1) triangles each\n");
+	printf("  -layers <n>                n quads covering the whole view, stacked in depth\n");
+	printf("  -lights <m>                m point lights (default %lld)\n", num_lights);
+	printf("  -size <s>                  object size relative to its depth (default %g)\n", object_size);
+	exit(0);
+}
+
+long long parse_count(const char * program, const char * arg)
+{
+	long long count = atoll(arg);
+	if (count < 0)
+		usage(program);
+	return count;
+}
+
+int main(int argc, char ** argv)
+{
+	char * output = NULL;
+	for (int i = 1; i < argc; i++)
+	{
+		if (argv[i][0] != '-' && output == NULL)
+			output = argv[i];
+		else if (strcasecmp(argv[i], "-seed") == 0 && i + 1 < argc)
+			seed = (unsigned int)strtoul(argv[++i], NULL, 10);
+		else if (strcasecmp(argv[i], "-triangles") == 0 && i + 1 < argc)
+			num_random_triangles = parse_count(argv[0], argv[++i]);
+		else if (strcasecmp(argv[i], "-spheres") == 0 && i + 1 < argc)
+			num_random_spheres = parse_count(argv[0], argv[++i]);
+		else if (strcasecmp(argv[i], "-tessellated") == 0 && i + 2 < argc)
+		{
+			num_tessellated = parse_count(argv[0], argv[++i]);
+			tessellation = atoi(argv[++i]);
+			if (tessellation < 2)
+				usage(argv[0]);
+		}
+		else if (strcasecmp(argv[i], "-layers") == 0 && i + 1 < argc)
+			num_layers = parse_count(argv[0], argv[++i]);
+		else if (strcasecmp(argv[i], "-lights") == 0 && i + 1 < argc)
+			num_lights = parse_count(argv[0], argv[++i]);
+		else if (strcasecmp(argv[i], "-size") == 0 && i + 1 < argc)
+		{
+			object_size = atof(argv[++i]);
+			if (object_size <= 0.0)
+				usage(argv[0]);
+		}
+		else
+			usage(argv[0]);
+	}
+	if (output == NULL)
+		usage(argv[0]);
+
+	long long triangles = num_random_triangles + num_tessellated * 2 * tessellation * (tessellation - 1) + num_layers * 2;
+	long long objects = triangles + num_random_spheres + num_lights;
+
+	FILE * file = fopen(output, "w");
+	if (file == NULL)
+	{
+		printf("cannot open %s\n", output);
+		exit(0);
+	}
+
+	rng.seed(seed);
+
+	fprintf(file, "%lld\n", objects);
+	write_doubles(file, "amb:", glm::dvec3(0.1, 0.1, 0.1));
+	write_random_triangles(file);
+	write_random_spheres(file);
+	write_tessellated_spheres(file);
+	write_layers(file);
+	write_lights(file);
+
+	if (fclose(file) != 0)
+	{
+		printf("error writing %s\n", output);
+		exit(0);
+	}
+
+	printf("%s: %lld triangles, %lld spheres, %lld lights (seed %u)\n", output, triangles, num_random_spheres, num_lights, seed);
+	if (triangles > MAX_TRIANGLES)
+		printf("more than %d triangles, render with hw3 -outofcore\n", MAX_TRIANGLES);
+	if (num_random_spheres > MAX_SPHERES)
+		printf("more than %d spheres, hw3 will not load this scene\n", MAX_SPHERES);
+	if (num_lights > MAX_LIGHTS)
+		printf("more than %d lights, hw3 will not load this scene\n", MAX_LIGHTS);
+	return 0;
+}